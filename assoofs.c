@@ -4,16 +4,55 @@
 #include <linux/fs.h>           /* libfs stuff           */
 #include <linux/buffer_head.h>  /* buffer_head           */
 #include <linux/slab.h>         /* kmem_cache            */
+#include <linux/uio.h>          /* iov_iter              */
+#include <linux/blkdev.h>       /* bdev_logical_block_size */
 #include "assoofs.h"
 
+// informacion de un inodo en memoria: la persistente (primer campo, para que i_private siga
+// pudiendo usarse como struct assoofs_inode_info *) mas el estado que nunca pasa a disco
+struct assoofs_inode_mem {
+    struct assoofs_inode_info info;
+    unsigned long state;
+    errseq_t store_err; // ultimo error de escritura del dispositivo visto por fsync (almacen de inodos compartido)
+};
+#define ASSOOFS_INODE_NEEDS_FLUSH 0 // hay escrituras que pueden seguir en la cache del dispositivo
+
+// informacion del superbloque en memoria: la persistente (primer campo, para que s_fs_info siga
+// pudiendo usarse como struct assoofs_super_block_info *) mas los cerrojos de este montaje
+struct assoofs_sb_mem {
+    struct assoofs_super_block_info info;
+    spinlock_t lock;        // protege free_blocks e inodes_count en memoria
+    struct mutex save_lock; // serializa la escritura a disco del superbloque
+};
+
+static inline struct assoofs_sb_mem *ASSOOFS_SB(struct super_block *sb){
+	return sb->s_fs_info;
+}
+
+static inline struct assoofs_inode_mem *ASSOOFS_I(struct inode *inode){
+	return inode->i_private;
+}
+
+// reservar la informacion en memoria de un inodo; se libera al desalojarlo
+static struct assoofs_inode_info *assoofs_alloc_inode_info(struct super_block *sb){
+	struct assoofs_inode_mem *mem = kzalloc(sizeof(struct assoofs_inode_mem), GFP_KERNEL);
+
+	if (!mem)
+		return NULL;
+	mem->store_err = errseq_sample(&sb->s_bdev->bd_inode->i_mapping->wb_err);
+	return &mem->info;
+}
+
 /*
  *  Operaciones sobre ficheros
  */
 ssize_t assoofs_read(struct file * filp, char __user * buf, size_t len, loff_t * ppos);
 ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, loff_t * ppos);
+static int assoofs_fsync(struct file *filp, loff_t start, loff_t end, int datasync);
 const struct file_operations assoofs_file_operations = {
     .read = assoofs_read,
     .write = assoofs_write,
+    .fsync = assoofs_fsync,
 };
 
 // obtener un puntero a la informacion persistente de un inodo concreto
@@ -33,54 +72,152 @@ assoofs_inode_info *search){
 		return NULL;
 }
 
-// actualizar en disco la informacion persistente de un inodo
-int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info){
+// copiar en el almacen de inodos la informacion persistente de un inodo; si sync es falso
+// el bloque solo se marca como sucio y llega a disco con la escritura diferida o con fsync
+static int assoofs_store_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info, bool sync){
 
-	struct assoofs_super_block_info *assoofs_sb;
 	struct buffer_head *bh;
 	struct assoofs_inode_info *inode_pos;
 	
 	bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
-	inode_info = (struct assoofs_inode_info *)bh->b_data;
-	assoofs_sb = (struct assoofs_super_block_info *)bh->b_data;
 
 	// buscar los datos de inode_info en el almacen
 	inode_pos = assoofs_search_inode_info(sb, (struct assoofs_inode_info *)bh->b_data, inode_info);
+	if (!inode_pos) {
+		brelse(bh);
+		return -EIO;
+	}
 
 	// actualizar el inodo
 	memcpy(inode_pos, inode_info, sizeof(*inode_pos));
 	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
+	if (sync)
+		sync_dirty_buffer(bh);
 
 	brelse(bh);
 	return 0;
 }
 
+// actualizar en disco la informacion persistente de un inodo
+int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info){
+	return assoofs_store_inode_info(sb, inode_info, true);
+}
+
+// traducir el bloque logico de un fichero al bloque de disco que lo contiene
+static int assoofs_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create){
+	struct assoofs_inode_info *inode_info = inode->i_private;
+
+	// cada fichero ocupa un unico bloque de datos, reservado al crearlo; mas alla queda sin mapear
+	if (iblock > 0)
+		return 0;
+
+	map_bh(bh_result, inode->i_sb, inode_info->data_block_number);
+	return 0;
+}
+
+static ssize_t assoofs_direct_IO(struct kiocb *iocb, struct iov_iter *iter){
+	struct inode *inode = file_inode(iocb->ki_filp);
+
+	return blockdev_direct_IO(iocb, inode, iter, assoofs_get_block);
+}
+
+/*
+ *  Operaciones sobre el espacio de direcciones de los ficheros
+ */
+static const struct address_space_operations assoofs_aops = {
+    .direct_IO = assoofs_direct_IO,
+};
+
+// transferir directamente entre el buffer de usuario y el disco la parte alineada de una peticion O_DIRECT.
+// Devuelve los bytes transferidos; la cola sin alinear la completa el llamador a traves del buffer cache.
+// En escrituras el llamador tiene que tener inode_lock, para que ninguna escritura por el buffer cache
+// ensucie el bloque entre el volcado previo y la invalidacion posterior.
+static ssize_t assoofs_direct_rw(struct file *filp, int rw, char __user *buf, size_t len, loff_t *ppos){
+	struct inode *inode = filp->f_path.dentry->d_inode;
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_inode_info *inode_info = inode->i_private;
+	unsigned int align = bdev_logical_block_size(sb->s_bdev) - 1;
+	struct buffer_head *bh;
+	struct iovec iov;
+	struct iov_iter iter;
+	struct kiocb kiocb;
+	ssize_t ret;
+
+	// la posicion y el buffer de usuario tienen que estar alineados al sector del dispositivo
+	if ((*ppos | (unsigned long)buf) & align)
+		return 0;
+	if (*ppos >= sb->s_maxbytes)
+		return 0;
+	len = min_t(size_t, len, sb->s_maxbytes - *ppos) & ~(size_t)align;
+	if (!len)
+		return 0;
+
+	ret = import_single_range(rw, buf, len, &iov, &iter);
+	if (ret)
+		return ret;
+	init_sync_kiocb(&kiocb, filp);
+	kiocb.ki_pos = *ppos;
+
+	// si el bloque esta en el buffer cache hay que volcarlo antes para no leer ni pisar datos antiguos
+	bh = sb_find_get_block(sb, inode_info->data_block_number);
+	if (bh && buffer_dirty(bh))
+		sync_dirty_buffer(bh);
+
+	ret = assoofs_direct_IO(&kiocb, &iter);
+
+	// tras escribir directamente, la copia del bloque en memoria queda obsoleta
+	if (bh) {
+		if (rw == WRITE && ret > 0)
+			clear_buffer_uptodate(bh);
+		brelse(bh);
+	}
+
+	// en un kiocb sincrono blockdev_direct_IO no mueve ki_pos: hay que avanzar la posicion aqui
+	if (ret > 0) {
+		*ppos += ret;
+		if (rw == WRITE)
+			set_bit(ASSOOFS_INODE_NEEDS_FLUSH, &ASSOOFS_I(inode)->state);
+	}
+	return ret;
+}
+
 ssize_t assoofs_read(struct file * filp, char __user * buf, size_t len, loff_t * ppos) {
     struct assoofs_inode_info *inode_info = filp->f_path.dentry->d_inode->i_private;
     struct buffer_head *bh;
 	char *buffer;
+	ssize_t done = 0;
 	int nbytes;
 
 	printk(KERN_INFO "Read request\n");
 
+	// con O_DIRECT la parte alineada se lee directamente del disco sobre el buffer de usuario
+	if (filp->f_flags & O_DIRECT) {
+		done = assoofs_direct_rw(filp, READ, buf, len, ppos);
+		if (done < 0)
+			return done;
+		buf += done;
+		len -= done;
+	}
+
     // comprobar el valor de ppos pos si hemos llegado al final del fichero
-    if (*ppos >= inode_info->file_size) return 0;
+    if (*ppos >= inode_info->file_size || !len) return done;
 
     // acceder al contenido del fichero
 	bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, inode_info->data_block_number);
 	buffer = (char *)bh->b_data;
+	buffer += *ppos;
 
 	// copiar en el buffer buf el contenido del fichero leido en el paso anterior
-	nbytes = min((size_t) inode_info->file_size, len); // Hay que comparar len con el tama~no del fichero por si llegamos al final del fichero
+	nbytes = min((size_t) (inode_info->file_size - *ppos), len); // Hay que comparar len con lo que queda de fichero por si llegamos al final del fichero
 	copy_to_user(buf, buffer, nbytes);
+	brelse(bh);
 
 	// incrementar el valor de ppos y devolver el numero de bytes leidos
 	*ppos += nbytes;
 
 	printk(KERN_INFO "Read SUCCESFULL\n");
 
-	return nbytes;
+	return done + nbytes;
 
 }
 
@@ -88,29 +225,140 @@ ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, l
     
     struct buffer_head *bh;
     char *buffer;
-    struct assoofs_inode_info *inode_info = filp->f_path.dentry->d_inode->i_private;
-    struct super_block *sb = filp->f_path.dentry->d_inode->i_sb;
+    struct inode *inode = filp->f_path.dentry->d_inode;
+    struct assoofs_inode_info *inode_info = inode->i_private;
+    struct super_block *sb = inode->i_sb;
+    ssize_t done = 0;
+    unsigned long left;
+    int err;
 
     printk(KERN_INFO "Write request\n");
-    
-    bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, inode_info->data_block_number);
-    buffer = (char *)bh->b_data;
-	buffer += *ppos;
-	copy_from_user(buffer, buf, len);
 
-	*ppos += len;
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
+	inode_lock(inode);
+
+	// con O_DIRECT la parte alineada se escribe directamente desde el buffer de usuario
+	if (filp->f_flags & O_DIRECT) {
+		done = assoofs_direct_rw(filp, WRITE, (char __user *)buf, len, ppos);
+		if (done < 0)
+			goto out;
+		buf += done;
+		len -= done;
+	}
+
+	// el fichero ocupa un unico bloque: lo que no cabe en el no se escribe
+	if (len && *ppos >= sb->s_maxbytes) {
+		if (!done) {
+			done = -EFBIG;
+			goto out;
+		}
+		len = 0;
+	}
+	if (len)
+		len = min_t(size_t, len, sb->s_maxbytes - *ppos);
+
+	// el resto (o toda la peticion sin O_DIRECT) pasa por el buffer cache
+	if (len) {
+		bh = sb_bread(sb, inode_info->data_block_number);
+		buffer = (char *)bh->b_data;
+		buffer += *ppos;
+		left = copy_from_user(buffer, buf, len);
+		len -= left;
+
+		// el bloque queda sucio en memoria y asociado al inodo; la aplicacion decide cuando hacerlo duradero con fsync
+		if (len) {
+			*ppos += len;
+			mark_buffer_dirty_inode(bh, inode);
+			set_bit(ASSOOFS_INODE_NEEDS_FLUSH, &ASSOOFS_I(inode)->state);
+			done += len;
+		}
+		brelse(bh);
+
+		// si no se ha podido copiar nada del buffer de usuario no hay nada que actualizar
+		if (!done) {
+			done = -EFAULT;
+			goto out;
+		}
+	}
 
-	inode_info->file_size = *ppos;
-	assoofs_save_inode_info(sb, inode_info);
+	// el almacen de inodos solo se toca si cambia el tamano del fichero
+	if (inode_info->file_size != *ppos) {
+		inode_info->file_size = *ppos;
+		i_size_write(inode, *ppos);
+		err = assoofs_store_inode_info(sb, inode_info, false);
+		if (err) {
+			done = err;
+			goto out;
+		}
+	}
 	
 	printk(KERN_INFO "Writed SUCCESFULL\n");
-	brelse(bh);
-	return len;
+out:
+	inode_unlock(inode);
+	return done;
 	
 }
 
+// volcar a disco solo los bloques sucios de un fichero, su bloque de datos y el almacen de inodos,
+// y vaciar la cache del dispositivo si se ha escrito algo desde el ultimo vaciado
+static int assoofs_sync_inode(struct inode *inode) {
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh;
+	bool flush;
+	int ret, err;
+
+	// lo escrito desde el ultimo vaciado, por el buffer cache o con O_DIRECT y por cualquier descriptor,
+	// puede estar solo en la cache volatil del dispositivo aunque los buffers ya esten limpios
+	flush = test_and_clear_bit(ASSOOFS_INODE_NEEDS_FLUSH, &ASSOOFS_I(inode)->state);
+
+	// bloque de datos del fichero, asociado al inodo con mark_buffer_dirty_inode
+	ret = sync_mapping_buffers(inode->i_mapping);
+
+	// el almacen de inodos es compartido y no se puede asociar a un unico inodo, asi que se trata aparte.
+	// assoofs no guarda fechas, asi que el unico metadato es el tamano y el almacen de inodos
+	// solo se ensucia cuando este cambia: si esta limpio, fsync y fdatasync no tienen nada mas que volcar
+	bh = sb_find_get_block(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+	if (bh) {
+		if (buffer_dirty(bh)) {
+			err = sync_dirty_buffer(bh);
+			if (!ret)
+				ret = err;
+			flush = true;
+		}
+		brelse(bh);
+	}
+
+	if (flush) {
+		err = blkdev_issue_flush(sb->s_bdev, GFP_KERNEL, NULL);
+		if (err)
+			set_bit(ASSOOFS_INODE_NEEDS_FLUSH, &ASSOOFS_I(inode)->state);
+		if (!ret)
+			ret = err;
+	}
+
+	return ret;
+}
+
+static int assoofs_fsync(struct file *filp, loff_t start, loff_t end, int datasync) {
+	struct inode *inode = filp->f_path.dentry->d_inode;
+	struct address_space *bdev_mapping = inode->i_sb->s_bdev->bd_inode->i_mapping;
+	int ret, err;
+
+	printk(KERN_INFO "Fsync request\n");
+
+	ret = assoofs_sync_inode(inode);
+
+	// los errores de la escritura diferida no los devuelve sync_mapping_buffers: el del bloque de datos
+	// queda en el errseq del fichero y el del almacen de inodos en el del dispositivo
+	err = file_check_and_advance_wb_err(filp);
+	if (!ret)
+		ret = err;
+	err = errseq_check_and_advance(&bdev_mapping->wb_err, &ASSOOFS_I(inode)->store_err);
+	if (!ret)
+		ret = err;
+
+	return ret;
+}
+
 /*
  *  Operaciones sobre directorios
  */
@@ -122,61 +370,108 @@ const struct file_operations assoofs_dir_operations = {
 
 void assoofs_save_sb_info(struct super_block *vsb){
 	
-	// leer de disco la informacion persistente del superbloque con sb_bread y sobreescribir el campo b_data con la informacion en memoria:
+	// leer de disco la informacion persistente del superbloque con sb_bread y copiar sobre ella la informacion en memoria:
 	struct buffer_head *bh;
-	struct assoofs_super_block *sb = vsb->s_fs_info; // Informacion persistente del superbloque en memoria
+	struct assoofs_sb_mem *asb = ASSOOFS_SB(vsb); // Informacion persistente del superbloque en memoria
+
+	mutex_lock(&asb->save_lock);
 	bh = sb_bread(vsb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
-	bh->b_data = (char *)sb; // Sobreescribo los datos de disco con la informacion en memoria
+	spin_lock(&asb->lock);
+	memcpy(bh->b_data, &asb->info, sizeof(asb->info)); // Sobreescribo los datos de disco con la informacion en memoria
+	spin_unlock(&asb->lock);
 
 	// marcar el buffer como sucio y sincronizar para que el cambio pase a disco
 	mark_buffer_dirty(bh);
 	sync_dirty_buffer(bh);
 	brelse(bh);
+	mutex_unlock(&asb->save_lock);
 }
 
-int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block){
+// grupo de asignacion al que pertenece un bloque
+static unsigned int assoofs_block_group(uint64_t block){
+	return block / ASSOOFS_BLOCKS_PER_GROUP;
+}
+
+// obtener un bloque libre empezando por el grupo de asignacion indicado
+int assoofs_sb_get_a_freeblock(struct super_block *sb, unsigned int group, uint64_t *block){
 	//obtener la informacion persistente del superbloque.
-	struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
+	struct assoofs_sb_mem *asb = ASSOOFS_SB(sb);
 	
-	int i;
-	for (i = 2; i < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++)
-		if (assoofs_sb->free_blocks & (1 << i))
-			break; // cuando aparece el primer bit 1 en free_block dejamos de recorrer el mapa de bits, i tiene la posicion del primer bloque libre
+	unsigned int g;
+	int i, first;
+
+	// consultar y ocupar el bit con el cerrojo tomado: dos creaciones concurrentes no pueden
+	// perder la actualizacion del mapa de bits ni quedarse con el mismo bloque
+	spin_lock(&asb->lock);
+
+	// recorrer los grupos a partir del pedido; si esta lleno se pasa al siguiente
+	for (g = 0; g < ASSOOFS_BLOCK_GROUPS; g++) {
+		first = ((group + g) % ASSOOFS_BLOCK_GROUPS) * ASSOOFS_BLOCKS_PER_GROUP;
+		for (i = max(first, 2); i < first + ASSOOFS_BLOCKS_PER_GROUP; i++)
+			if (asb->info.free_blocks & (1ULL << i))
+				goto found;
+	}
 
-	*block = i; // Escribimos el valor de i en la direccion de memoria indicada como segundo argumento en la funcion
+	spin_unlock(&asb->lock);
+	return -ENOSPC;
 
-	//Actualizar el valor de free_blocks y guardar los cambios en el superbloque
-	assoofs_sb->free_blocks &= ~(1 << i);
+found:
+	asb->info.free_blocks &= ~(1ULL << i);
+	spin_unlock(&asb->lock);
+
+	*block = i; // Escribimos el valor de i en la direccion de memoria indicada como ultimo argumento en la funcion
+
+	// guardar los cambios en el superbloque
 	assoofs_save_sb_info(sb);
 	return 0;
 }
 
-// guardar en disco la informacion persistente de un nuevo inodo
-void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode){
+// devolver al mapa de bits un bloque que no se ha llegado a usar
+static void assoofs_sb_put_a_freeblock(struct super_block *sb, uint64_t block){
+	struct assoofs_sb_mem *asb = ASSOOFS_SB(sb);
+
+	spin_lock(&asb->lock);
+	asb->info.free_blocks |= 1ULL << block;
+	spin_unlock(&asb->lock);
+	assoofs_save_sb_info(sb);
+}
+
+// reservar numero de inodo y hueco en el almacen para un inodo nuevo y guardar en disco su informacion persistente
+int assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode){
 
 	// acceder a la informacion persistente en el superbloque para obtener el contador de inodos
 	struct buffer_head *bh;
-	struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
+	struct assoofs_sb_mem *asb = ASSOOFS_SB(sb);
 	struct assoofs_inode_info *inode_info;
 
 	// leer de disco el bloque que contiene el almacen de inodos
 	bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
 
-	// obtener un puntero al final del almacen y escribir un nuevo valor al final
+	// el numero de inodo sale del contador y el hueco es el final del almacen: ambos se reservan a la vez con
+	// el cerrojo tomado, porque el VFS solo bloquea el directorio padre y puede haber creaciones concurrentes
+	spin_lock(&asb->lock);
+	if (asb->info.inodes_count >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED) {
+		spin_unlock(&asb->lock);
+		brelse(bh);
+		return -ENOSPC;
+	}
+	inode->inode_no = asb->info.inodes_count + 1;
 	inode_info = (struct assoofs_inode_info *)bh->b_data;
-	inode_info += assoofs_sb->inodes_count;
+	inode_info += asb->info.inodes_count;
 	memcpy(inode_info, inode, sizeof(struct assoofs_inode_info));
+	asb->info.inodes_count++;
+	spin_unlock(&asb->lock);
 
 	// marcar el bloque como sucio y sincronizar
 	mark_buffer_dirty(bh);
 	sync_dirty_buffer(bh);
+	brelse(bh);
 
-	// actualizar el contador de inodos de la informacion persistente del superbloque y guardar los cambios
-	assoofs_sb->inodes_count++;
+	// guardar los cambios del contador de inodos en el superbloque
 	assoofs_save_sb_info(sb);
+	return 0;
 }
 
-
 /*
  *  Operaciones sobre inodos
  */
@@ -201,7 +496,7 @@ struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64
 
 	for (i = 0; i < afs_sb->inodes_count; i++) {
 		if (inode_info->inode_no == inode_no) {
-			buffer = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
+			buffer = assoofs_alloc_inode_info(sb);
 			memcpy(buffer, inode_info, sizeof(*buffer));
 			break;
 		}
@@ -225,9 +520,11 @@ static struct inode *assoofs_get_inode(struct super_block *sb, int ino){
 
 	if (S_ISDIR(inode_info->mode))
 		inode->i_fop = &assoofs_dir_operations;
-	else if (S_ISREG(inode_info->mode))
+	else if (S_ISREG(inode_info->mode)) {
 		inode->i_fop = &assoofs_file_operations;
-	else
+		inode->i_mapping->a_ops = &assoofs_aops;
+		inode->i_size = inode_info->file_size;
+	} else
 		printk(KERN_ERR "Unknown inode type. Neither a directory nor a file.");
 
 	inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
@@ -304,7 +601,6 @@ struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_d
 static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl) {
     //1. Crear el nuevo inodo
     struct inode *inode;
-	uint64_t count;
 	struct super_block *sb;
 	struct assoofs_inode_info *inode_info;
 	struct assoofs_inode_info *parent_inode_info;
@@ -314,32 +610,39 @@ static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode
 	printk(KERN_INFO "New file request\n");
 
 	sb = dir->i_sb; // obtengo un puntero al superbloque desde dir
-	count = ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count; // obtengo el numero de inodos de la informacion persistente del superbloque
 	inode = new_inode(sb);
-	if(count > ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED){
-		return -1;
-	}
-	inode->i_ino = count + 1; // Asigno numero al nuevo inodo a partir de count
-
-	inode->i_ino = count + 1;
 	inode->i_sb = sb;
 	inode->i_op = &assoofs_inode_ops;
 	inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
 	inode->i_fop=&assoofs_file_operations;
+	inode->i_mapping->a_ops = &assoofs_aops; // necesario para poder abrir el fichero con O_DIRECT
 
-	inode_info = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
-	inode_info->inode_no = inode->i_ino;
+	inode_info = assoofs_alloc_inode_info(sb);
 	inode_info->mode = mode; // mode me llega como argumento
 	inode_info->file_size = 0;
+
+	// el bloque de datos se busca en el grupo del directorio padre para que sus ficheros queden juntos
+	parent_inode_info = dir->i_private;
+	if (assoofs_sb_get_a_freeblock(sb, assoofs_block_group(parent_inode_info->data_block_number), &inode_info->data_block_number)) {
+		kfree(inode_info);
+		iput(inode);
+		return -ENOSPC;
+	}
+
+	// assoofs_add_inode_info asigna el numero de inodo al reservar su hueco en el almacen
+	if (assoofs_add_inode_info(sb, inode_info)) {
+		assoofs_sb_put_a_freeblock(sb, inode_info->data_block_number);
+		kfree(inode_info);
+		iput(inode);
+		return -ENOSPC;
+	}
+	inode->i_ino = inode_info->inode_no;
+
 	inode->i_private = inode_info;
 	inode_init_owner(inode, dir, mode);
 	d_add(dentry, inode);
 
-	assoofs_sb_get_a_freeblock(sb, &inode_info->data_block_number);
-	assoofs_add_inode_info(sb, inode_info);
-
 	//2. Modificar el contenido del directorio padre
-	parent_inode_info = dir->i_private;
 	bh = sb_bread(sb, parent_inode_info->data_block_number);
 	
 	dir_contents = (struct assoofs_dir_record_entry *)bh->b_data;
@@ -361,7 +664,6 @@ static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode
 static int assoofs_mkdir(struct inode *dir , struct dentry *dentry, umode_t mode) {
     //1. Crear el nuevo inodo
     struct inode *inode;
-	uint64_t count;
 	struct super_block *sb;
 	struct assoofs_inode_info *inode_info;
 	struct assoofs_inode_info *parent_inode_info;
@@ -371,18 +673,29 @@ static int assoofs_mkdir(struct inode *dir , struct dentry *dentry, umode_t mode
 	printk(KERN_INFO "New directory request\n");
 
 	sb = dir->i_sb; // obtengo un puntero al superbloque desde dir
-	count = ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count; // obtengo el numero de inodos de la informacion persistente del superbloque
 	inode = new_inode(sb);
-	if(count > ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED){
-		return -1;
-	}
-	inode->i_ino = count + 1; // Asigno numero al nuevo inodo a partir de count
 
-	inode_info = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
-	inode_info->inode_no = inode->i_ino;
+	inode_info = assoofs_alloc_inode_info(sb);
 	inode_info->dir_children_count = 0;
 	inode_info->mode = S_IFDIR | mode; // mode me llega como argumento
 	inode_info->file_size = 0;
+
+	// los directorios nuevos se reparten entre grupos segun la CPU, y sus ficheros los seguiran a ese grupo
+	if (assoofs_sb_get_a_freeblock(sb, raw_smp_processor_id() % ASSOOFS_BLOCK_GROUPS, &inode_info->data_block_number)) {
+		kfree(inode_info);
+		iput(inode);
+		return -ENOSPC;
+	}
+
+	// assoofs_add_inode_info asigna el numero de inodo al reservar su hueco en el almacen
+	if (assoofs_add_inode_info(sb, inode_info)) {
+		assoofs_sb_put_a_freeblock(sb, inode_info->data_block_number);
+		kfree(inode_info);
+		iput(inode);
+		return -ENOSPC;
+	}
+	inode->i_ino = inode_info->inode_no;
+
 	inode->i_private = inode_info;
 
 	inode->i_fop = &assoofs_dir_operations;
@@ -393,9 +706,6 @@ static int assoofs_mkdir(struct inode *dir , struct dentry *dentry, umode_t mode
 	inode_init_owner(inode, dir, inode_info->mode);
 	d_add(dentry, inode);
 
-	assoofs_sb_get_a_freeblock(sb, &inode_info->data_block_number);
-	assoofs_add_inode_info(sb, inode_info);
-
 	//2. Modificar el contenido del directorio padre
 	parent_inode_info = dir->i_private;
 	bh = sb_bread(sb, parent_inode_info->data_block_number);
@@ -419,8 +729,25 @@ static int assoofs_mkdir(struct inode *dir , struct dentry *dentry, umode_t mode
 /*
  *  Operaciones sobre el superbloque
  */
+// al desalojar el inodo se pierden su asociacion con los buffers de datos y su estado en memoria, asi que
+// antes se vuelca lo pendiente para que un fsync tras volver a abrir el fichero no se quede sin efecto
+static void assoofs_evict_inode(struct inode *inode){
+	truncate_inode_pages_final(&inode->i_data);
+	if (inode->i_private)
+		assoofs_sync_inode(inode);
+	invalidate_inode_buffers(inode);
+	clear_inode(inode);
+	kfree(inode->i_private);
+}
+
+static void assoofs_put_super(struct super_block *sb){
+	kfree(sb->s_fs_info);
+}
+
 static const struct super_operations assoofs_sops = {
     .drop_inode = generic_delete_inode,
+    .evict_inode = assoofs_evict_inode,
+    .put_super = assoofs_put_super,
 };
 
 /*
@@ -430,6 +757,7 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
     // 1.- Leer la información persistente del superbloque del dispositivo de bloques
     struct buffer_head *bh;
 	struct assoofs_super_block_info *assoofs_sb;
+	struct assoofs_sb_mem *asb;
 	struct inode *root_inode;
 
 	printk(KERN_INFO "assoofs_fill_super request\n");
@@ -451,7 +779,17 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
     sb->s_magic = assoofs_sb->magic;
     sb->s_maxbytes = assoofs_sb->block_size;
     sb->s_op = &assoofs_sops;
-    sb->s_fs_info = assoofs_sb;
+
+    // la informacion persistente se copia a memoria propia del montaje, junto con sus cerrojos
+    asb = kzalloc(sizeof(struct assoofs_sb_mem), GFP_KERNEL);
+    if (!asb) {
+    	brelse(bh);
+    	return -ENOMEM;
+    }
+    memcpy(&asb->info, assoofs_sb, sizeof(asb->info));
+    spin_lock_init(&asb->lock);
+    mutex_init(&asb->save_lock);
+    sb->s_fs_info = asb;
 
     // 4.- Crear el inodo raíz y asignarle operaciones sobre inodos (i_op) y sobre directorios (i_fop)
     root_inode = new_inode(sb);
@@ -466,6 +804,8 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
 
 	sb->s_root = d_make_root(root_inode);
 	if(!sb->s_root){
+		kfree(asb);
+		sb->s_fs_info = NULL;
 		brelse(bh);
 		return -1;
 	}
@@ -3,6 +3,8 @@
 #define ASSOOFS_FILENAME_MAXLEN 255
 #define ASSOOFS_LAST_RESERVED_BLOCK ASSOOFS_ROOTDIR_BLOCK_NUMBER
 #define ASSOOFS_LAST_RESERVED_INODE ASSOOFS_ROOTDIR_INODE_NUMBER
+#define ASSOOFS_BLOCKS_PER_GROUP 16
+#define ASSOOFS_BLOCK_GROUPS (ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED / ASSOOFS_BLOCKS_PER_GROUP) // grupos de asignacion en que se divide el mapa de bloques libres
 const int ASSOOFS_SUPERBLOCK_BLOCK_NUMBER = 0;
 const int ASSOOFS_INODESTORE_BLOCK_NUMBER = 1;
 const int ASSOOFS_ROOTDIR_BLOCK_NUMBER = 2;